@@ -1,12 +1,16 @@
 #include "bchart.h"
 
-void draw_block(ppm *image, int start_x, int start_y, double value) {
-  int i, j;
+pixel bchart_block_pixel(double value) {
   unsigned int r = 255 - (255 * value);
   unsigned int g = 255 - (149 * value);
   unsigned int b = 255U;
 
-  pixel px = make_pixel(r, g, b);
+  return make_pixel(r, g, b);
+}
+
+void draw_block(ppm *image, int start_x, int start_y, double value) {
+  int i, j;
+  pixel px = bchart_block_pixel(value);
   for(i = 1; i < BLOCK_WIDTH; i++)
     for (j = 1; j < BLOCK_HEIGHT; j++)
       set_pixel(image, i+start_x, j+start_y, px);
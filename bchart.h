@@ -4,6 +4,9 @@
  * @brief Block chart represents
  */
 
+#ifndef BCHART_H
+#define BCHART_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include "ppm.h"
@@ -11,6 +14,13 @@
 #define BLOCK_WIDTH 20
 #define BLOCK_HEIGHT 20
 
+/** @brief Identifies how block values are mapped to colours.
+ *
+ * Must be changed whenever bchart_block_pixel() changes so charts cached with
+ * the old colours are not reused.
+ */
+#define BCHART_COLOUR_MAP 1
+
 /** @brief Represents a block chart.
  */
 typedef struct block_chart {
@@ -27,6 +37,11 @@ typedef struct block_chart {
  */
 BlockChart *bchart_init(int max_blocks, int max_lines);
 
+/** @brief Returns the colour of a block showing the given value.
+ * @param[in] value Between 0 (white) and 1 (blue).
+ */
+pixel bchart_block_pixel(double value);
+
 /** @brief Draws blocks based on the provided data.
  */
 void bchart_draw_blocks(BlockChart *chart, const double data[], int data_size);
@@ -44,3 +59,5 @@ void bchart_save(BlockChart *chart, char output_file[]);
  * The chart pointer cannot be used after this function returns.
  */
 void bchart_dispose(BlockChart *chart);
+
+#endif
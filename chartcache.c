@@ -0,0 +1,290 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "bchart.h"
+#include "chartcache.h"
+
+#define HASH_MASK 0xffffffffUL
+
+ChartKey hash_byte(ChartKey key, unsigned int byte) {
+  key.fnv = ((key.fnv ^ byte) * 16777619UL) & HASH_MASK;
+  key.djb = ((key.djb << 5) + key.djb + byte) & HASH_MASK;
+  return key;
+}
+
+ChartKey hash_int(ChartKey key, unsigned int value) {
+  int i;
+  for (i = 0; i < 4; i++)
+    key = hash_byte(key, (value >> (8 * i)) & 0xff);
+  return key;
+}
+
+ChartKey ccache_key_init(int max_blocks, int max_lines) {
+  ChartKey key;
+  key.fnv = 2166136261UL;
+  key.djb = 5381UL;
+
+  key = hash_int(key, BLOCK_WIDTH);
+  key = hash_int(key, BLOCK_HEIGHT);
+  key = hash_int(key, BCHART_COLOUR_MAP);
+  key = hash_int(key, max_blocks);
+  key = hash_int(key, max_lines);
+  return key;
+}
+
+ChartKey ccache_key_update(ChartKey key, const double data[], int data_size) {
+  int i;
+  pixel px;
+
+  for (i = 0; i < data_size; i++) {
+    px = bchart_block_pixel(data[i]);
+    key = hash_byte(key, get_red(px));
+    key = hash_byte(key, get_green(px));
+    key = hash_byte(key, get_blue(px));
+  }
+  return key;
+}
+
+void entry_path(ChartCache *cache, ChartKey key, char path[]) {
+  sprintf(path, "%s/%08lx%08lx.pnm", cache->directory, key.fnv, key.djb);
+}
+
+void index_path(ChartCache *cache, char path[]) {
+  sprintf(path, "%s/index.txt", cache->directory);
+}
+
+int find_entry(ChartCache *cache, ChartKey key) {
+  int i;
+  for (i = 0; i < cache->entries_count; i++)
+    if (cache->entries[i].key.fnv == key.fnv && cache->entries[i].key.djb == key.djb)
+      return i;
+  return -1;
+}
+
+void remove_entry(ChartCache *cache, int index) {
+  char path[CCACHE_MAX_PATH + 32];
+
+  entry_path(cache, cache->entries[index].key, path);
+  remove(path);
+  cache->used_bytes -= cache->entries[index].size;
+  cache->entries_count--;
+  cache->entries[index] = cache->entries[cache->entries_count];
+}
+
+int file_exists(const char path[]) {
+  struct stat info;
+  return stat(path, &info) == 0;
+}
+
+/* Removes least recently used charts until a chart of size bytes fits */
+void evict(ChartCache *cache, long size) {
+  int i, oldest;
+
+  while (cache->entries_count > 0 &&
+      (cache->entries_count == CCACHE_MAX_ENTRIES ||
+       cache->used_bytes + size > cache->max_bytes)) {
+    oldest = 0;
+    for (i = 1; i < cache->entries_count; i++)
+      if (cache->entries[i].last_used < cache->entries[oldest].last_used)
+        oldest = i;
+    remove_entry(cache, oldest);
+  }
+}
+
+/* Brings the index in line with the directory. Entries whose chart is gone
+ * are dropped, and charts missing from the index, e.g. after the index was
+ * lost or truncated, are added as least recently used so they still count
+ * towards the size bound. */
+void reconcile(ChartCache *cache) {
+  char path[CCACHE_MAX_PATH + 32];
+  struct stat info;
+  struct dirent *file;
+  ChartKey key;
+  DIR *directory;
+  int i;
+
+  for (i = cache->entries_count - 1; i >= 0; i--) {
+    entry_path(cache, cache->entries[i].key, path);
+    if (!file_exists(path)) {
+      cache->used_bytes -= cache->entries[i].size;
+      cache->entries[i] = cache->entries[--cache->entries_count];
+    }
+  }
+
+  directory = opendir(cache->directory);
+  if (directory == NULL)
+    return;
+
+  while ((file = readdir(directory)) != NULL) {
+    if (strlen(file->d_name) != 20 || strcmp(file->d_name + 16, ".pnm") != 0 ||
+        strspn(file->d_name, "0123456789abcdef") != 16 ||
+        sscanf(file->d_name, "%8lx%8lx", &key.fnv, &key.djb) != 2 ||
+        find_entry(cache, key) >= 0)
+      continue;
+
+    entry_path(cache, key, path);
+    if (stat(path, &info) != 0)
+      continue;
+    if (cache->entries_count == CCACHE_MAX_ENTRIES) {
+      remove(path);
+      continue;
+    }
+    cache->entries[cache->entries_count].key = key;
+    cache->entries[cache->entries_count].size = info.st_size;
+    cache->entries[cache->entries_count].last_used = 0;
+    cache->entries_count++;
+    cache->used_bytes += info.st_size;
+  }
+  closedir(directory);
+
+  evict(cache, 0);
+}
+
+/* Makes destination refer to the same contents as source, preferably by a
+ * hard link and otherwise by copying. Returns 1 on success. */
+int link_or_copy(const char source[], const char destination[]) {
+  FILE *in, *out;
+  char buffer[4096];
+  size_t read_count;
+  int ok;
+
+  if (link(source, destination) == 0)
+    return 1;
+
+  in = fopen(source, "rb");
+  if (in == NULL)
+    return 0;
+  out = fopen(destination, "wb");
+  if (out == NULL) {
+    fclose(in);
+    return 0;
+  }
+
+  ok = 1;
+  while ((read_count = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    if (fwrite(buffer, 1, read_count, out) != read_count)
+      ok = 0;
+
+  fclose(in);
+  if (fclose(out) != 0)
+    ok = 0;
+  return ok;
+}
+
+ChartCache *ccache_open(const char directory[], long max_bytes) {
+  ChartCache *cache = malloc(sizeof(ChartCache));
+  char path[CCACHE_MAX_PATH + 32];
+  ChartCacheEntry entry;
+  FILE *index;
+
+  if (cache == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  strncpy(cache->directory, directory, CCACHE_MAX_PATH - 1);
+  cache->directory[CCACHE_MAX_PATH - 1] = '\0';
+  cache->max_bytes = max_bytes;
+  cache->used_bytes = 0;
+  cache->entries_count = 0;
+  cache->clock = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+
+  mkdir(cache->directory, 0755);
+
+  index_path(cache, path);
+  index = fopen(path, "r");
+  if (index != NULL) {
+    if (fscanf(index, " %lu %lu %lu", &cache->hits, &cache->misses, &cache->clock) == 3) {
+      while (cache->entries_count < CCACHE_MAX_ENTRIES &&
+          fscanf(index, " %lx %lx %ld %lu",
+            &entry.key.fnv, &entry.key.djb, &entry.size, &entry.last_used) == 4) {
+        cache->entries[cache->entries_count++] = entry;
+        cache->used_bytes += entry.size;
+      }
+    }
+    fclose(index);
+  }
+  reconcile(cache);
+
+  return cache;
+}
+
+int ccache_fetch(ChartCache *cache, ChartKey key, char output_file[]) {
+  char path[CCACHE_MAX_PATH + 32];
+  int index = find_entry(cache, key);
+
+  remove(output_file);
+
+  if (index >= 0) {
+    entry_path(cache, key, path);
+    if (link_or_copy(path, output_file)) {
+      cache->entries[index].last_used = ++cache->clock;
+      cache->hits++;
+      return 1;
+    }
+    /* Only forget the chart when it has disappeared from the directory,
+     * not when the output could not be written */
+    if (!file_exists(path))
+      remove_entry(cache, index);
+  }
+
+  cache->misses++;
+  return 0;
+}
+
+void ccache_store(ChartCache *cache, ChartKey key, char output_file[]) {
+  char path[CCACHE_MAX_PATH + 32];
+  struct stat info;
+  int i;
+
+  if (stat(output_file, &info) != 0 || info.st_size > cache->max_bytes)
+    return;
+
+  if ((i = find_entry(cache, key)) >= 0)
+    remove_entry(cache, i);
+
+  evict(cache, info.st_size);
+
+  entry_path(cache, key, path);
+  remove(path);
+  if (!link_or_copy(output_file, path)) {
+    remove(path);
+    return;
+  }
+
+  cache->entries[cache->entries_count].key = key;
+  cache->entries[cache->entries_count].size = info.st_size;
+  cache->entries[cache->entries_count].last_used = ++cache->clock;
+  cache->entries_count++;
+  cache->used_bytes += info.st_size;
+}
+
+void ccache_close(ChartCache *cache) {
+  char path[CCACHE_MAX_PATH + 32];
+  FILE *index;
+  int i;
+
+  index_path(cache, path);
+  index = fopen(path, "w");
+  if (index != NULL) {
+    fprintf(index, "%lu %lu %lu\n", cache->hits, cache->misses, cache->clock);
+    for (i = 0; i < cache->entries_count; i++)
+      fprintf(index, "%08lx %08lx %ld %lu\n",
+          cache->entries[i].key.fnv,
+          cache->entries[i].key.djb,
+          cache->entries[i].size,
+          cache->entries[i].last_used);
+    fclose(index);
+  }
+
+  free(cache);
+}
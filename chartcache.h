@@ -0,0 +1,84 @@
+/**
+ * @file chartcache.h
+ * @author A400a
+ * @brief Content-addressed cache of rendered block charts.
+ *
+ * Charts are keyed by a hash of the colours of their blocks and the
+ * rendering parameters. A chart whose key is already cached is hard linked
+ * to the output file instead of being rendered and written again. The cache
+ * directory is bounded in size and evicts the least recently used charts.
+ */
+
+#ifndef CHARTCACHE_H
+#define CHARTCACHE_H
+
+#define CCACHE_MAX_ENTRIES 256
+#define CCACHE_MAX_PATH 256
+
+/** @brief Identifies a chart by the blocks it shows and how they are rendered.
+ *
+ * Two independent 32-bit hashes (FNV-1a and djb2) of the same bytes.
+ */
+typedef struct chart_key {
+  unsigned long fnv;
+  unsigned long djb;
+} ChartKey;
+
+/** @brief A chart stored in the cache directory. */
+typedef struct chart_cache_entry {
+  ChartKey key;
+  long size;
+  unsigned long last_used;
+} ChartCacheEntry;
+
+/** @brief Represents a chart cache directory and its index. */
+typedef struct chart_cache {
+  char directory[CCACHE_MAX_PATH];
+  long max_bytes;
+  long used_bytes;
+  int entries_count;
+  ChartCacheEntry entries[CCACHE_MAX_ENTRIES];
+  unsigned long clock;
+  unsigned long hits;
+  unsigned long misses;
+} ChartCache;
+
+/** @brief Opens the cache in the given directory, creating it if needed.
+ * @param[in] directory Where cached charts and the index are kept.
+ * @param[in] max_bytes Upper bound on the total size of cached charts.
+ */
+ChartCache *ccache_open(const char directory[], long max_bytes);
+
+/** @brief Starts the key of a chart with the given dimensions.
+ *
+ * The key covers BLOCK_WIDTH, BLOCK_HEIGHT and BCHART_COLOUR_MAP.
+ */
+ChartKey ccache_key_init(int max_blocks, int max_lines);
+
+/** @brief Adds a line of block values to the key.
+ *
+ * Values are hashed by the colour they are drawn with, so values that
+ * render the same produce the same key.
+ */
+ChartKey ccache_key_update(ChartKey key, const double data[], int data_size);
+
+/** @brief Emits the cached chart for key as output_file.
+ *
+ * Returns 1 on a hit. On a miss 0 is returned and output_file is removed, so
+ * the caller can render it afresh and pass it to ccache_store().
+ */
+int ccache_fetch(ChartCache *cache, ChartKey key, char output_file[]);
+
+/** @brief Adds a freshly rendered output_file to the cache under key.
+ *
+ * Least recently used charts are evicted to stay within the size bound.
+ */
+void ccache_store(ChartCache *cache, ChartKey key, char output_file[]);
+
+/** @brief Writes the index and releases the cache.
+ *
+ * The cache pointer cannot be used after this function returns.
+ */
+void ccache_close(ChartCache *cache);
+
+#endif